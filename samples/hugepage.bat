@@ -0,0 +1,10 @@
+@echo off
+rem	Build hugepage.c and compare fork latency and child throughput with
+rem	and without large pages for some arena sizes.
+rem	Run from Visual Studio command prompt in samples directory.
+
+cl /nologo /Od hugepage.c ..\src\DkFork.c /link /DYNAMICBASE:NO >nul || exit /b 1
+for %%m in (64 256 512) do (
+	hugepage.exe %%m small
+	hugepage.exe %%m large
+)
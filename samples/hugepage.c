@@ -0,0 +1,113 @@
+/*+
+	Benchmark DkFork() with an arena on large pages versus small pages.
+	Parent allocate an arena with DkForkAllocArena(), fill it and call DkFork(). Fork latency
+	is measured from just before DkFork() call to the point where child and parent return
+	from DkFork(), start time is a local variable so child get it from copied stack frame.
+	Child then measure steady-state throughput with random reads over the arena, that
+	is where large pages save TLB misses. Parent measure its own throughput only after
+	child exit, so the two measurements don't compete for memory and TLB.
+	Large pages need Windows Vista or higher and "Lock pages in memory" privilege, if not
+	available DkForkAllocArena() use small pages, check the page size printed.
+
+	Usage  : hugepage [size in MB] [large|small]
+	Compile: cl /Od hugepage.c ..\src\DkFork.c /link /DYNAMICBASE:NO
+-*/
+
+#define BENCH_DEF_SIZE_MB			256
+#define BENCH_READ_COUNT			(16 * 1024 * 1024)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <process.h>
+
+#include "Windows.h"
+
+extern int DkFork(long long lMainAddr);
+extern void* DkForkAllocArena(size_t stSize, int fLargePage);
+extern int DkForkFreeArena(void* pArena);
+extern size_t DkForkArenaPageSize(void* pArena);
+
+double elapsed_ms(LONGLONG start)
+{
+	LARGE_INTEGER	now = {0}, freq = {0};
+
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&freq);
+
+	return ((double) (now.QuadPart - start) * 1000.0) / (double) freq.QuadPart;
+}
+
+/*+
+ *	Random 4 bytes reads over arena (linear congruential generator), return
+ *	nano seconds per read.
+-*/
+double read_throughput(unsigned int* arena, unsigned int count)
+{
+	LARGE_INTEGER	start = {0};
+	unsigned int	i = 0, idx = 1, sum = 0;
+	double			ms = 0;
+
+	QueryPerformanceCounter(&start);
+	for (i = 0; i < BENCH_READ_COUNT; i++) {
+		idx = (idx * 1664525) + 1013904223;
+		sum += arena[idx % count];
+	}
+	ms = elapsed_ms(start.QuadPart);
+	if (sum == 0x12345678) printf("\r\n");		// Keep sum alive
+
+	return (ms * 1000000.0) / (double) BENCH_READ_COUNT;
+}
+
+int main(int argc, char* argv[])
+{
+	int				i = 0, large = 1;
+	size_t			size = (size_t) BENCH_DEF_SIZE_MB * 1024 * 1024;
+	unsigned int*	arena = NULL;
+	unsigned int	count = 0, n = 0;
+	LARGE_INTEGER	start = {0};
+	double			fork_ms = 0;
+	HANDLE			hChild = NULL;
+
+	if (argc > 1) size = (size_t) atoi(argv[1]) * 1024 * 1024;
+	if (argc > 2) large = (strcmp(argv[2], "small") != 0);
+
+	arena = (unsigned int*) DkForkAllocArena(size, large);
+	if (!arena) {
+		printf("(PID=%d) Error DkForkAllocArena()! (%d)\r\n", _getpid(), GetLastError());
+		return -1;
+	}
+	count = (unsigned int) (size / sizeof(unsigned int));
+	for (n = 0; n < count; n++) {
+		arena[n] = n;
+	}
+	printf("(PID=%d) Arena %u MB, %s pages requested, page size %u bytes.\r\n", _getpid(),
+		(unsigned int) (size / (1024 * 1024)), large ? "large" : "small",
+		(unsigned int) DkForkArenaPageSize(arena));
+
+	QueryPerformanceCounter(&start);
+	i = DkFork((long long) &main);
+	fork_ms = elapsed_ms(start.QuadPart);
+	if (i == -1) {
+		printf("(PID=%d) Error DkFork()\r\n", _getpid());
+		return -1;
+	}
+	if (i == 0) {
+		printf("(PID=%d) Child: page size %u bytes, fork latency %.3f ms, random read %.2f ns/read.\r\n",
+			_getpid(), (unsigned int) DkForkArenaPageSize(arena), fork_ms, read_throughput(arena, count));
+		DkForkFreeArena(arena);
+		return 0;
+	}
+
+	// Wait for child first, so parent and child don't measure at the same time
+	hChild = OpenProcess(SYNCHRONIZE, FALSE, (DWORD) i);
+	if (hChild) {
+		WaitForSingleObject(hChild, INFINITE);
+		CloseHandle(hChild);
+	}
+	printf("(PID=%d) Parent: DkFork() return after %.3f ms, random read %.2f ns/read.\r\n",
+		_getpid(), fork_ms, read_throughput(arena, count));
+	DkForkFreeArena(arena);
+
+	return 0;
+}
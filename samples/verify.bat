@@ -0,0 +1,65 @@
+@echo off
+rem	Build all samples and verify stress programs with DkFork() verification mode
+rem	(DKFRK_VERIFY), run them and fail when a child report a mismatch.
+rem	Run from Visual Studio command prompt in samples directory.
+
+setlocal
+set VFY_CL=cl /nologo /Od /DDKFRK_VERIFY
+set VFY_LINK=/link /DYNAMICBASE:NO
+set VFY_FAIL=0
+set VFY_TIMEOUT=30
+
+for %%s in (simple simple2 simple3 pipe) do call :vfy_sample %%s
+call :vfy_stress verify_small 0x10000 4
+call :vfy_stress verify_mid 0x1000000 32
+call :vfy_stress verify_large 0x10000000 48
+call :vfy_hugepage small
+call :vfy_hugepage large
+
+if %VFY_FAIL% neq 0 (
+	echo DkFork verify: %VFY_FAIL% program^(s^) FAILED
+	exit /b 1
+)
+echo DkFork verify: all programs OK
+exit /b 0
+
+rem	Samples don't wait for child, so wait until child finish its report
+:vfy_sample
+%VFY_CL% %1.c ..\src\DkFork.c %VFY_LINK% >nul || (set /a VFY_FAIL+=1 & goto :eof)
+%1.exe > %1.vfy.txt 2>&1
+call :vfy_wait %1
+call :vfy_check %1
+goto :eof
+
+rem	Stress program wait for child and return its exit code
+:vfy_stress
+%VFY_CL% /DVFY_SECTION_SIZE=%2 /DVFY_STACK_DEPTH=%3 /Fe%1.exe verify.c ..\src\DkFork.c %VFY_LINK% >nul || (set /a VFY_FAIL+=1 & goto :eof)
+%1.exe > %1.vfy.txt 2>&1
+if %errorlevel% neq 0 set /a VFY_FAIL+=1
+call :vfy_check %1
+goto :eof
+
+rem	Arena transfer, hugepage wait for child but don't return its exit code
+:vfy_hugepage
+%VFY_CL% /Fehugepage_vfy.exe hugepage.c ..\src\DkFork.c %VFY_LINK% >nul || (set /a VFY_FAIL+=1 & goto :eof)
+hugepage_vfy.exe 64 %1 > hugepage_%1.vfy.txt 2>&1
+call :vfy_wait hugepage_%1
+call :vfy_check hugepage_%1
+goto :eof
+
+rem	Poll for the end of child report, at most VFY_TIMEOUT seconds
+:vfy_wait
+set VFY_TRY=0
+:vfy_wait_loop
+findstr /C:"DkFork verify done" %1.vfy.txt >nul 2>&1 && goto :eof
+if %VFY_TRY% geq %VFY_TIMEOUT% goto :eof
+set /a VFY_TRY+=1
+ping -n 2 127.0.0.1 >nul
+goto vfy_wait_loop
+
+:vfy_check
+type %1.vfy.txt
+findstr /C:"DkFork verify done" %1.vfy.txt >nul || (echo %1: no verification report & set /a VFY_FAIL+=1 & goto :eof)
+findstr /C:"FAILED" %1.vfy.txt >nul && (echo %1: verification FAILED & set /a VFY_FAIL+=1)
+findstr /C:"REWRITTEN" %1.vfy.txt >nul && echo %1: WARNING, some blocks rewritten before main, see REWRITTEN ranges
+goto :eof
@@ -0,0 +1,121 @@
+/*+
+	Stress sample for DkFork() verification mode.
+	Parent fill a large global table and recurse into deep stack frames, each frame with
+	its own filled buffer, then call DkFork() at the deepest frame. DkFork() verification
+	mode check every transferred region and report to stderr, this sample also check
+	the table and every frame by itself when child return. Parent wait for child and
+	return child exit code, so a script can run it.
+	Size of the table and depth of the stack can be set with VFY_SECTION_SIZE and
+	VFY_STACK_DEPTH, note that DkFork() walk 64 stack frames at most.
+
+	Compile: cl /Od /DDKFRK_VERIFY verify.c ..\src\DkFork.c /link /DYNAMICBASE:NO
+	         cl /Od /DDKFRK_VERIFY /DVFY_SECTION_SIZE=0x10000000 /DVFY_STACK_DEPTH=48 verify.c ..\src\DkFork.c /link /DYNAMICBASE:NO
+-*/
+
+#ifndef VFY_SECTION_SIZE
+# define VFY_SECTION_SIZE			0x1000000		// 16 MB
+#endif
+#ifndef VFY_STACK_DEPTH
+# define VFY_STACK_DEPTH			32
+#endif
+#define VFY_FRAME_BUF_SIZE			4096
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <process.h>
+
+#include "Windows.h"
+
+extern int DkFork(long long lMainAddr);
+extern int DkForkVerifyMismatch();
+
+int main(int argc, char* argv[]);
+
+unsigned char	big_tbl[VFY_SECTION_SIZE];
+
+int check_tbl()
+{
+	unsigned int	i = 0;
+
+	for (i = 0; i < VFY_SECTION_SIZE; i++) {
+		if (big_tbl[i] != (unsigned char) ((i * 31) + 7)) {
+			printf("(PID=%d) Table mismatch at offset 0x%X!\r\n", _getpid(), i);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*+
+ *	Return DkFork() result from the deepest frame, and -2 when a frame buffer
+ *	don't carry what parent wrote to it.
+-*/
+int deep_frame(int depth)
+{
+	unsigned char	buf[VFY_FRAME_BUF_SIZE];
+	int				i = 0, res = 0;
+
+	for (i = 0; i < VFY_FRAME_BUF_SIZE; i++) {
+		buf[i] = (unsigned char) (depth + i);
+	}
+
+	if (depth < VFY_STACK_DEPTH) {
+		res = deep_frame(depth + 1);
+	} else {
+		res = DkFork((long long) &main);
+	}
+
+	for (i = 0; i < VFY_FRAME_BUF_SIZE; i++) {
+		if (buf[i] != (unsigned char) (depth + i)) {
+			printf("(PID=%d) Frame %d mismatch at offset %d!\r\n", _getpid(), depth, i);
+			return -2;
+		}
+	}
+
+	return res;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int	i = 0;
+	int				res = 0;
+	HANDLE			hChild = NULL;
+	DWORD			dwExit = 0;
+
+	printf("(PID=%d) DkFork() verification, table=%u bytes, depth=%d.\r\n",
+		_getpid(), VFY_SECTION_SIZE, VFY_STACK_DEPTH);
+
+	for (i = 0; i < VFY_SECTION_SIZE; i++) {
+		big_tbl[i] = (unsigned char) ((i * 31) + 7);
+	}
+
+	res = deep_frame(1);
+	if (res == -1) {
+		printf("(PID=%d) Error DkFork()\r\n", _getpid());
+		return -1;
+	}
+	if (res == 0) {
+		if (!check_tbl()) return 1;
+		if (DkForkVerifyMismatch() != 0) {
+			printf("(PID=%d) Child: verification failed, %d block(s) mismatch.\r\n",
+				_getpid(), DkForkVerifyMismatch());
+			return 1;
+		}
+		printf("(PID=%d) Child: verification OK.\r\n", _getpid());
+		return 0;
+	}
+	if (res == -2) return 1;
+
+	hChild = OpenProcess(SYNCHRONIZE | PROCESS_QUERY_INFORMATION, FALSE, (DWORD) res);
+	if (!hChild) {
+		printf("(PID=%d) Error OpenProcess()! (%d)\r\n", _getpid(), GetLastError());
+		return -1;
+	}
+	WaitForSingleObject(hChild, INFINITE);
+	GetExitCodeProcess(hChild, &dwExit);
+	CloseHandle(hChild);
+	printf("(PID=%d) Parent: child %d exit with %d.\r\n", _getpid(), res, dwExit);
+
+	return (int) dwExit;
+}
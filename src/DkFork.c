@@ -51,6 +51,7 @@
 
 #pragma comment(lib, "PsApi.lib")
 #pragma comment(lib, "DbgHelp.lib")
+#pragma comment(lib, "AdvApi32.lib")
 
 /*+ 
  * I don't know what the name of this exception, so for now just call it
@@ -59,6 +60,20 @@
 -*/
 #define DKFRK_VS_DEBUG_EXCEPTION				0x406D1388
 
+/*+
+ *	Max number of arenas that can be registered with DkForkAllocArena(), and
+ *	page size used when large page is not available.
+-*/
+#define DKFRK_MAX_ARENAS						8
+#define DKFRK_SMALL_PAGE_SIZE					4096
+#define DKFRK_ARENA_COPY_CHUNK					0x200000		// Arena copy unit, same for every page size
+
+/*+
+ *	Size of child stack committed below copied stack frames, for the code child run
+ *	after DkFork() return. Stack grows through a guard page below it.
+-*/
+#define DKFRK_CHILD_STACK_MARGIN				0x10000
+
 /*+
  *	Some debugging function, just send message to debugger
 -*/
@@ -82,6 +97,432 @@ static void DkOutDbg(const char* szSrc, const char* szMsg, DWORD dwErr)
 # define DK_DBG(Src, Msg, Err)
 #endif
 
+/*+
+ *	Fork verification mode, compile with /DDKFRK_VERIFY to enable it.
+ *	Parent hashes every region it transfers (.data section, stack frames and arenas) in
+ *	blocks, right before it write the region to the child, and time the hashing and
+ *	the copy. The result is written to child in its own section (.dkvfy) so it is
+ *	not part of any transferred region. Child then hash the same regions again in
+ *	ChildForkProc(), before it return from DkFork(), and report mismatching ranges
+ *	and timing to stderr and debugger.
+ *	Child run its C run-time startup between .data copy and main function, and the
+ *	startup rewrite some globals (heap, environment, argv, C++ static initializers). 
+ *	Parent also hash child .data before the copy. At main function break point parent 
+ *	read .data back from child, block that still hold pre-copy content is stale and 
+ *	stay a mismatch, other changed block is "rewritten before main". Rewritten blocks 
+ *	are reported apart (verify.bat warns on them) and don't fail verification, only 
+ *	blocks changed after that point are mismatch.
+-*/
+#ifdef DKFRK_VERIFY
+
+#define DKFRK_VFY_MAGIC						0x564B4644		// "DFKV"
+#define DKFRK_VFY_BLOCK_SIZE				4096
+#define DKFRK_VFY_MAX_BLOCKS				8192
+#define DKFRK_VFY_MAX_RANGES				16				// Max mismatch ranges reported per region
+
+#define DKFRK_VFY_REGION_DATA				0
+#define DKFRK_VFY_REGION_STACK				1
+#define DKFRK_VFY_REGION_ARENA				2				// First arena, one region per arena
+#define DKFRK_VFY_REGION_COUNT				(DKFRK_VFY_REGION_ARENA + DKFRK_MAX_ARENAS)
+
+#define DKFRK_VFY_BITMAP_SIZE				(DKFRK_VFY_MAX_BLOCKS / 32)
+#define DKFRK_VFY_BIT_SET(Map, Blk)			((Map)[(Blk) >> 5] |= (1UL << ((Blk) & 31)))
+#define DKFRK_VFY_BIT_GET(Map, Blk)			(((Map)[(Blk) >> 5] >> ((Blk) & 31)) & 1)
+
+typedef struct _DKFRK_VFY_REGION {
+	CHAR		szName[8];
+	DWORD		dwAddr;
+	DWORD		dwSize;
+	DWORD		dwBlkSize;
+	DWORD		dwBlkCount;
+	DWORD		dwParHashUs;
+	DWORD		dwCopyUs;
+	DWORD		dwChildHashUs;
+	DWORD		dwMismatchBlks;
+	DWORD		dwRewrittenBlks;
+	LONGLONG	llCopyStart;
+	DWORD		adwRewritten[DKFRK_VFY_BITMAP_SIZE];
+	DWORD		adwMismatch[DKFRK_VFY_BITMAP_SIZE];
+	DWORD		adwHash[DKFRK_VFY_MAX_BLOCKS];
+} DKFRK_VFY_REGION;
+
+typedef struct _DKFRK_VFY_RECORD {
+	DWORD				dwMagic;
+	DWORD				dwTotalMismatch;
+	DKFRK_VFY_REGION	Regions[DKFRK_VFY_REGION_COUNT];
+} DKFRK_VFY_RECORD;
+
+#pragma section(".dkvfy", read, write)
+__declspec(allocate(".dkvfy")) static DKFRK_VFY_RECORD	gVfyRec = {0};
+__declspec(allocate(".dkvfy")) static CHAR				gSzVfyOut[256] = {0};
+__declspec(allocate(".dkvfy")) static DWORD				gadwVfyPreHash[DKFRK_VFY_MAX_BLOCKS] = {0};
+
+static LONGLONG DkVfyTick()
+{
+	LARGE_INTEGER	li = {0};
+
+	QueryPerformanceCounter(&li);
+	return li.QuadPart;
+}
+
+static DWORD DkVfyElapsedUs(LONGLONG llStart)
+{
+	LARGE_INTEGER	liFreq = {0};
+
+	QueryPerformanceFrequency(&liFreq);
+	if (liFreq.QuadPart == 0) return 0;
+
+	return (DWORD) (((DkVfyTick() - llStart) * 1000000) / liFreq.QuadPart);
+}
+
+/*+
+ *	FNV-1a, good enough to catch stale bytes and cheap to run on both sides.
+-*/
+static DWORD DkVfyHash(const UCHAR* pData, DWORD dwLen)
+{
+	DWORD	dwHash = 0x811C9DC5;
+	DWORD	dw = 0;
+
+	for (dw = 0; dw < dwLen; dw++) {
+		dwHash ^= pData[dw];
+		dwHash *= 0x01000193;
+	}
+
+	return dwHash;
+}
+
+/*+
+ *	Forget regions of previous fork, arenas may have been freed since then.
+-*/
+static void DkVfyReset()
+{
+	int		iIdx = 0;
+
+	gVfyRec.dwMagic = 0;
+	gVfyRec.dwTotalMismatch = 0;
+	for (iIdx = 0; iIdx < DKFRK_VFY_REGION_COUNT; iIdx++) {
+		gVfyRec.Regions[iIdx].szName[0] = 0;
+	}
+}
+
+static DWORD DkVfyBlockLen(DKFRK_VFY_REGION* pReg, DWORD dwBlk)
+{
+	DWORD	dwOff = dwBlk * pReg->dwBlkSize;
+
+	if ((pReg->dwSize - dwOff) < pReg->dwBlkSize) return (pReg->dwSize - dwOff);
+
+	return pReg->dwBlkSize;
+}
+
+/*+
+ *	Called by parent right before a region is written to child. Block size is doubled
+ *	until the region fits in DKFRK_VFY_MAX_BLOCKS, so large sections are still covered.
+ *	Arena regions get their arena index appended to the name (arena0, arena1, ...).
+-*/
+static void DkVfyParentRegion(int iIdx, const char* szName, DWORD dwAddr, DWORD dwSize)
+{
+	DKFRK_VFY_REGION*	pReg = &(gVfyRec.Regions[iIdx]);
+	LONGLONG			llStart = DkVfyTick();
+	DWORD				dw = 0;
+
+	gVfyRec.dwMagic = DKFRK_VFY_MAGIC;
+	if (iIdx >= DKFRK_VFY_REGION_ARENA) {
+		StringCbPrintfA(pReg->szName, sizeof(pReg->szName), "%s%d", szName, iIdx - DKFRK_VFY_REGION_ARENA);
+	} else {
+		StringCbCopyA(pReg->szName, sizeof(pReg->szName), szName);
+	}
+	pReg->dwAddr = dwAddr;
+	pReg->dwSize = dwSize;
+	pReg->dwBlkSize = DKFRK_VFY_BLOCK_SIZE;
+	while (((dwSize + pReg->dwBlkSize - 1) / pReg->dwBlkSize) > DKFRK_VFY_MAX_BLOCKS) {
+		pReg->dwBlkSize <<= 1;
+	}
+	pReg->dwBlkCount = (dwSize + pReg->dwBlkSize - 1) / pReg->dwBlkSize;
+	pReg->dwRewrittenBlks = 0;
+	RtlZeroMemory(pReg->adwRewritten, sizeof(pReg->adwRewritten));
+	for (dw = 0; dw < pReg->dwBlkCount; dw++) {
+		pReg->adwHash[dw] = DkVfyHash((const UCHAR*) (dwAddr + (dw * pReg->dwBlkSize)), DkVfyBlockLen(pReg, dw));
+	}
+	pReg->dwParHashUs = DkVfyElapsedUs(llStart);
+	pReg->llCopyStart = DkVfyTick();
+}
+
+static void DkVfyParentCopyDone(int iIdx)
+{
+	DKFRK_VFY_REGION*	pReg = &(gVfyRec.Regions[iIdx]);
+
+	pReg->dwCopyUs = DkVfyElapsedUs(pReg->llCopyStart);
+}
+
+/*+
+ *	Read a block of a region from child and hash it.
+-*/
+static BOOL DkVfyChildBlockHash(HANDLE hProc, DKFRK_VFY_REGION* pReg, DWORD dwBlk, UCHAR* pBuf, DWORD* pdwHash)
+{
+	DWORD	dwLen = DkVfyBlockLen(pReg, dwBlk);
+	SIZE_T	stRet = 0;
+
+	if (!ReadProcessMemory(hProc, (LPCVOID) (pReg->dwAddr + (dwBlk * pReg->dwBlkSize)), pBuf, dwLen, &stRet)) return FALSE;
+	if (stRet != dwLen) return FALSE;
+	*pdwHash = DkVfyHash(pBuf, dwLen);
+
+	return TRUE;
+}
+
+/*+
+ *	Called by parent at create process debug event, after DkVfyParentRegion() and 
+ *	right before .data is written to child. Hash child .data as loaded, so a block 
+ *	that still has this content at main function break point is known stale. If 
+ *	a block can not be read, parent hash is used and the block can not be stale.
+-*/
+static void DkVfyParentPreCopy(HANDLE hProc)
+{
+	DKFRK_VFY_REGION*	pReg = &(gVfyRec.Regions[DKFRK_VFY_REGION_DATA]);
+	UCHAR*				pBuf = NULL;
+	DWORD				dw = 0;
+
+	pBuf = (UCHAR*) HeapAlloc(GetProcessHeap(), 0, pReg->dwBlkSize);
+	for (dw = 0; dw < pReg->dwBlkCount; dw++) {
+		if ((!pBuf) || (!DkVfyChildBlockHash(hProc, pReg, dw, pBuf, &(gadwVfyPreHash[dw])))) {
+			gadwVfyPreHash[dw] = pReg->adwHash[dw];
+		}
+	}
+	if (pBuf) HeapFree(GetProcessHeap(), 0, pBuf);
+	pReg->llCopyStart = DkVfyTick();
+}
+
+/*+
+ *	Called by parent after it patch child .data on purpose (see TransferArenas()), 
+ *	take child content of the patched blocks as expected, so they are neither 
+ *	mismatch nor blamed on child startup.
+-*/
+static void DkVfyParentRehash(HANDLE hProc, DWORD dwAddr, DWORD dwLen)
+{
+	DKFRK_VFY_REGION*	pReg = &(gVfyRec.Regions[DKFRK_VFY_REGION_DATA]);
+	UCHAR*				pBuf = NULL;
+	DWORD				dw = 0, dwLast = 0;
+
+	if ((pReg->szName[0] == 0) || (dwLen == 0)) return;
+	if ((dwAddr < pReg->dwAddr) || ((dwAddr + dwLen) > (pReg->dwAddr + pReg->dwSize))) return;
+
+	pBuf = (UCHAR*) HeapAlloc(GetProcessHeap(), 0, pReg->dwBlkSize);
+	if (!pBuf) {
+		DK_DBG(__FUNCTION__, "Error HeapAlloc()!", GetLastError());
+		return;
+	}
+	dwLast = (dwAddr + dwLen - 1 - pReg->dwAddr) / pReg->dwBlkSize;
+	for (dw = (dwAddr - pReg->dwAddr) / pReg->dwBlkSize; dw <= dwLast; dw++) {
+		DkVfyChildBlockHash(hProc, pReg, dw, pBuf, &(pReg->adwHash[dw]));
+	}
+	HeapFree(GetProcessHeap(), 0, pBuf);
+}
+
+/*+
+ *	Called by parent at main function break point, before stack frames are copied. 
+ *	Read back .data from child, only .data because nothing in child write arenas 
+ *	before main. A block equal to parent is fine, a block still equal to pre-copy 
+ *	content is stale and left as is so child report it as mismatch, any other block 
+ *	is marked rewritten by child startup and its hash replaced by child content, so 
+ *	child only report changes made after main function break point.
+-*/
+static void DkVfyParentRewritten(HANDLE hProc)
+{
+	DKFRK_VFY_REGION*	pReg = &(gVfyRec.Regions[DKFRK_VFY_REGION_DATA]);
+	UCHAR*				pBuf = NULL;
+	DWORD				dw = 0, dwHash = 0;
+
+	if (pReg->szName[0] == 0) return;
+
+	pBuf = (UCHAR*) HeapAlloc(GetProcessHeap(), 0, pReg->dwBlkSize);
+	if (!pBuf) {
+		DK_DBG(__FUNCTION__, "Error HeapAlloc()!", GetLastError());
+		return;
+	}
+	for (dw = 0; dw < pReg->dwBlkCount; dw++) {
+		if (!DkVfyChildBlockHash(hProc, pReg, dw, pBuf, &dwHash)) continue;
+		if ((dwHash == pReg->adwHash[dw]) || (dwHash == gadwVfyPreHash[dw])) continue;
+
+		DKFRK_VFY_BIT_SET(pReg->adwRewritten, dw);
+		pReg->adwHash[dw] = dwHash;
+		pReg->dwRewrittenBlks += 1;
+	}
+	HeapFree(GetProcessHeap(), 0, pBuf);
+}
+
+/*+
+ *	Write verification record to child, must be the last write before child is resumed.
+ *	Only record header and populated regions are written, each region up to its last 
+ *	block hash. Unused part of the record in child stay zero as loaded.
+-*/
+static BOOL DkVfyParentTransfer(HANDLE hProc)
+{
+	BOOL				fRes = FALSE;
+	SIZE_T				stRet = 0, stLen = 0;
+	DKFRK_VFY_REGION*	pReg = NULL;
+	int					iIdx = 0;
+
+	stLen = FIELD_OFFSET(DKFRK_VFY_RECORD, Regions);
+	fRes = WriteProcessMemory(hProc, (LPVOID) &gVfyRec, (LPCVOID) &gVfyRec, stLen, &stRet);
+	for (iIdx = 0; (iIdx < DKFRK_VFY_REGION_COUNT) && fRes && (stRet == stLen); iIdx++)
+	{
+		pReg = &(gVfyRec.Regions[iIdx]);
+		if (pReg->szName[0] == 0) continue;
+
+		stLen = FIELD_OFFSET(DKFRK_VFY_REGION, adwHash) + (pReg->dwBlkCount * sizeof(DWORD));
+		fRes = WriteProcessMemory(hProc, (LPVOID) pReg, (LPCVOID) pReg, stLen, &stRet);
+	}
+	if ((!fRes) || (stRet != stLen)) {
+		DK_DBG(__FUNCTION__, "Error write verification record to child!", GetLastError());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void DkVfyOut()
+{
+	HANDLE		hErr = GetStdHandle(STD_ERROR_HANDLE);
+	DWORD		dwRet = 0;
+	size_t		stLen = 0;
+
+	OutputDebugStringA(gSzVfyOut);
+	if ((hErr != NULL) && (hErr != INVALID_HANDLE_VALUE)) {
+		if (StringCbLengthA(gSzVfyOut, sizeof(gSzVfyOut), &stLen) == S_OK) {
+			WriteFile(hErr, gSzVfyOut, (DWORD) stLen, &dwRet, NULL);
+		}
+	}
+}
+
+/*+
+ *	Report ranges of consecutive blocks that are set in a bitmap.
+-*/
+static void DkVfyReportRanges(DKFRK_VFY_REGION* pReg, const DWORD* pdwMap, const char* szLabel)
+{
+	DWORD	dw = 0, dwFirst = 0, dwRanges = 0;
+
+	for (dw = 0; dw < pReg->dwBlkCount; dw++)
+	{
+		if (!DKFRK_VFY_BIT_GET(pdwMap, dw)) continue;
+
+		dwFirst = dw;
+		while (((dw + 1) < pReg->dwBlkCount) && DKFRK_VFY_BIT_GET(pdwMap, dw + 1)) dw++;
+
+		if (dwRanges == DKFRK_VFY_MAX_RANGES) {
+			StringCbPrintfA(gSzVfyOut, sizeof(gSzVfyOut), "DkFork verify:   ... more %s ranges not shown\r\n", szLabel);
+			DkVfyOut();
+			return;
+		}
+		StringCbPrintfA(gSzVfyOut, sizeof(gSzVfyOut), "DkFork verify:   %s 0x%08X-0x%08X\r\n", szLabel,
+			pReg->dwAddr + (dwFirst * pReg->dwBlkSize), pReg->dwAddr + (dw * pReg->dwBlkSize) + DkVfyBlockLen(pReg, dw));
+		DkVfyOut();
+		dwRanges++;
+	}
+}
+
+/*+
+ *	Executed by child from ChildForkProc(), stack pointer is at the end of copied
+ *	stack frames so it must keep its own stack usage small. All regions are hashed 
+ *	first and only then reported, because reporting use C run-time and Windows API 
+ *	that may touch .data section. All state is kept in .dkvfy section.
+-*/
+static void DkVfyChild()
+{
+	DKFRK_VFY_REGION*	pReg = NULL;
+	LONGLONG			llStart = 0;
+	DWORD				dw = 0;
+	int					iIdx = 0;
+
+	if (gVfyRec.dwMagic != DKFRK_VFY_MAGIC) {
+		StringCbPrintfA(gSzVfyOut, sizeof(gSzVfyOut),
+			"DkFork verify (PID=%u): FAILED, no verification record from parent\r\n", GetCurrentProcessId());
+		DkVfyOut();
+		StringCbPrintfA(gSzVfyOut, sizeof(gSzVfyOut), "DkFork verify done (PID=%u)\r\n", GetCurrentProcessId());
+		DkVfyOut();
+		return;
+	}
+
+	gVfyRec.dwTotalMismatch = 0;
+	for (iIdx = 0; iIdx < DKFRK_VFY_REGION_COUNT; iIdx++)
+	{
+		pReg = &(gVfyRec.Regions[iIdx]);
+		if (pReg->szName[0] == 0) continue;
+
+		pReg->dwMismatchBlks = 0;
+		RtlZeroMemory(pReg->adwMismatch, sizeof(pReg->adwMismatch));
+		llStart = DkVfyTick();
+		for (dw = 0; dw < pReg->dwBlkCount; dw++) {
+			if (DkVfyHash((const UCHAR*) (pReg->dwAddr + (dw * pReg->dwBlkSize)), DkVfyBlockLen(pReg, dw)) != pReg->adwHash[dw]) {
+				DKFRK_VFY_BIT_SET(pReg->adwMismatch, dw);
+				pReg->dwMismatchBlks += 1;
+			}
+		}
+		pReg->dwChildHashUs = DkVfyElapsedUs(llStart);
+		gVfyRec.dwTotalMismatch += pReg->dwMismatchBlks;
+	}
+
+	for (iIdx = 0; iIdx < DKFRK_VFY_REGION_COUNT; iIdx++)
+	{
+		pReg = &(gVfyRec.Regions[iIdx]);
+		if (pReg->szName[0] == 0) continue;
+
+		StringCbPrintfA(gSzVfyOut, sizeof(gSzVfyOut),
+			"DkFork verify (PID=%u): %s 0x%08X-0x%08X (%u blocks of %u bytes)\r\n",
+			GetCurrentProcessId(), pReg->szName, pReg->dwAddr, pReg->dwAddr + pReg->dwSize,
+			pReg->dwBlkCount, pReg->dwBlkSize);
+		DkVfyOut();
+		DkVfyReportRanges(pReg, pReg->adwRewritten, "REWRITTEN");
+		DkVfyReportRanges(pReg, pReg->adwMismatch, "MISMATCH");
+
+		StringCbPrintfA(gSzVfyOut, sizeof(gSzVfyOut),
+			"DkFork verify:   %s, parent hash %u us, copy %u us, child hash %u us, "
+			"%u block(s) rewritten before main, %u block(s) mismatch\r\n",
+			(pReg->dwMismatchBlks == 0) ? "OK" : "FAILED",
+			pReg->dwParHashUs, pReg->dwCopyUs, pReg->dwChildHashUs, 
+			pReg->dwRewrittenBlks, pReg->dwMismatchBlks);
+		DkVfyOut();
+	}
+
+	StringCbPrintfA(gSzVfyOut, sizeof(gSzVfyOut), "DkFork verify done (PID=%u)\r\n", GetCurrentProcessId());
+	DkVfyOut();
+}
+
+/*+
+ *	Return number of mismatch blocks found by child verification, 0 in parent.
+-*/
+int DkForkVerifyMismatch()
+{
+	return (int) gVfyRec.dwTotalMismatch;
+}
+
+# define DK_VFY_REGION(Idx, Name, Addr, Size)	DkVfyParentRegion(Idx, Name, (DWORD) (Addr), (DWORD) (Size))
+# define DK_VFY_COPY_DONE(Idx)					DkVfyParentCopyDone(Idx)
+# define DK_VFY_TRANSFER(hProc)					DkVfyParentTransfer(hProc)
+# define DK_VFY_REWRITTEN(hProc)				DkVfyParentRewritten(hProc)
+# define DK_VFY_PRECOPY(hProc)					DkVfyParentPreCopy(hProc)
+# define DK_VFY_REHASH(hProc, Addr, Len)		DkVfyParentRehash(hProc, (DWORD) (Addr), (DWORD) (Len))
+# define DK_VFY_RESET()							DkVfyReset()
+#else
+# define DK_VFY_REGION(Idx, Name, Addr, Size)
+# define DK_VFY_COPY_DONE(Idx)
+# define DK_VFY_TRANSFER(hProc)					TRUE
+# define DK_VFY_REWRITTEN(hProc)
+# define DK_VFY_PRECOPY(hProc)
+# define DK_VFY_REHASH(hProc, Addr, Len)
+# define DK_VFY_RESET()
+#endif
+
+/*+
+ *	Fork-inherited arena, see DkForkAllocArena().
+-*/
+typedef struct _DKFRK_ARENA {
+	LPVOID		pBase;
+	SIZE_T		stSize;
+	SIZE_T		stPageSize;
+	DWORD		dwAllocType;
+} DKFRK_ARENA;
+
+typedef SIZE_T (WINAPI *DKFRK_GET_LARGE_PAGE_MIN)(void);
+
 static DWORD						gdwMainFuncAddr;
 static TCHAR						gSzFullImgName[512];
 static HANDLE						ghParProc;
@@ -91,12 +532,17 @@ static BOOL							gfFirstBreakpoint;
 static ULONG64						gulStartBaseFrameAddr;
 static ULONG64						gulEndBaseFrameAddr;
 static BOOL							gfDetachChild;
+static DKFRK_ARENA					gArenas[DKFRK_MAX_ARENAS];
 
 static void InitStaticVars();
 static BOOL CreateProcDbgEvtHandler();
 static BOOL ExcDbgEvtHandler();
 static BOOL BreakpointExcHandler();
 static BOOL GetStartAndEndFrame();
+static SIZE_T GetLargePageSize();
+static BOOL EnableLockMemPrivilege();
+static BOOL TransferArenas();
+static BOOL CommitChildStack();
 static int ChildForkProc();
 
 /*+
@@ -192,6 +638,140 @@ int DkFork(long long lMainProgAddr)
 	return (int) pi.dwProcessId;
 }
 
+/*+
+ *	Allocate an arena that will be inherited by child process of next DkFork() calls. 
+ *	Child get its own arena at the same address with the same content. If fLargePage 
+ *	is not 0, arena is placed on large pages (2 MB on Intel processor) in parent and 
+ *	child, this need "Lock pages in memory" privilege and Windows Vista or higher. 
+ *	If large page can not be used, small pages are used instead. Return NULL on 
+ *	error.
+-*/
+void* DkForkAllocArena(size_t stSize, int fLargePage)
+{
+	int			iIdx = 0;
+	SIZE_T		stPageSize = DKFRK_SMALL_PAGE_SIZE, stLargePage = 0;
+	DWORD		dwAllocType = 0;
+	LPVOID		pBase = NULL;
+
+	if (stSize == 0) return NULL;
+
+	for (iIdx = 0; iIdx < DKFRK_MAX_ARENAS; iIdx++) {
+		if (gArenas[iIdx].pBase == NULL) break;
+	}
+	if (iIdx >= DKFRK_MAX_ARENAS) return NULL;
+
+	if (fLargePage) {
+		stLargePage = GetLargePageSize();
+		if ((stLargePage != 0) && EnableLockMemPrivilege()) {
+			stPageSize = stLargePage;
+			dwAllocType = MEM_LARGE_PAGES;
+		} else {
+			DK_DBG(__FUNCTION__, "Large page not available, use small pages!", GetLastError());
+		}
+	}
+
+	stSize = ((stSize + stPageSize - 1) / stPageSize) * stPageSize;
+	pBase = VirtualAlloc(NULL, stSize, MEM_RESERVE | MEM_COMMIT | dwAllocType, PAGE_READWRITE);
+	if ((!pBase) && (dwAllocType != 0)) {
+		DK_DBG(__FUNCTION__, "Error VirtualAlloc() with large pages, use small pages!", GetLastError());
+		stPageSize = DKFRK_SMALL_PAGE_SIZE;
+		dwAllocType = 0;
+		pBase = VirtualAlloc(NULL, stSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+	if (!pBase) return NULL;
+
+	gArenas[iIdx].pBase = pBase;
+	gArenas[iIdx].stSize = stSize;
+	gArenas[iIdx].stPageSize = stPageSize;
+	gArenas[iIdx].dwAllocType = dwAllocType;
+
+	return pBase;
+}
+
+/*+
+ *	Free an arena returned by DkForkAllocArena(), in parent or child process.
+ *	Return 0 on success otherwise return -1.
+-*/
+int DkForkFreeArena(void* pArena)
+{
+	int		iIdx = 0;
+
+	for (iIdx = 0; iIdx < DKFRK_MAX_ARENAS; iIdx++) {
+		if ((pArena != NULL) && (gArenas[iIdx].pBase == pArena)) {
+			if (!VirtualFree(pArena, 0, MEM_RELEASE)) return -1;
+			RtlZeroMemory(&(gArenas[iIdx]), sizeof(DKFRK_ARENA));
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*+
+ *	Return page size of an arena returned by DkForkAllocArena(), this tell if arena 
+ *	is really on large pages. Return 0 if it is not a registered arena.
+-*/
+size_t DkForkArenaPageSize(void* pArena)
+{
+	int		iIdx = 0;
+
+	for (iIdx = 0; iIdx < DKFRK_MAX_ARENAS; iIdx++) {
+		if ((pArena != NULL) && (gArenas[iIdx].pBase == pArena)) {
+			return gArenas[iIdx].stPageSize;
+		}
+	}
+
+	return 0;
+}
+
+/*+
+ *	Return large page size, or 0 if system don't support large page.
+ *	GetLargePageMinimum() is not available in Windows XP so it is loaded
+ *	at run time.
+-*/
+static SIZE_T GetLargePageSize()
+{
+	HMODULE						hKernel = NULL;
+	DKFRK_GET_LARGE_PAGE_MIN	pfnGetLargePageMin = NULL;
+
+	hKernel = GetModuleHandle(_T("Kernel32.dll"));
+	if (!hKernel) return 0;
+
+	pfnGetLargePageMin = (DKFRK_GET_LARGE_PAGE_MIN) GetProcAddress(hKernel, "GetLargePageMinimum");
+	if (!pfnGetLargePageMin) return 0;
+
+	return pfnGetLargePageMin();
+}
+
+/*+
+ *	Enable "Lock pages in memory" privilege (SeLockMemoryPrivilege) of current process,
+ *	it is required to allocate large pages. User must have this privilege assigned, 
+ *	AdjustTokenPrivileges() only enable it.
+-*/
+static BOOL EnableLockMemPrivilege()
+{
+	BOOL				fRes = FALSE;
+	HANDLE				hToken = NULL;
+	TOKEN_PRIVILEGES	tp = {0};
+
+	fRes = OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken);
+	if (!fRes) return FALSE;
+
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	fRes = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &(tp.Privileges[0].Luid));
+	if (fRes) {
+		fRes = AdjustTokenPrivileges(hToken, FALSE, &tp, 0, NULL, NULL);
+		if (fRes && (GetLastError() == ERROR_NOT_ALL_ASSIGNED)) {
+			fRes = FALSE;
+		}
+	}
+
+	CloseHandle(hToken);
+
+	return fRes;
+}
+
 /*+
  *	Initialization function
 -*/
@@ -205,6 +785,7 @@ static void InitStaticVars()
 	gulEndBaseFrameAddr = 0;
 	gulStartBaseFrameAddr = 0;
 	gfDetachChild = FALSE;
+	DK_VFY_RESET();
 }
 
 /*+
@@ -271,7 +852,7 @@ static BOOL GetStartAndEndFrame()
  *	Handling a create process debug event.
  *	This function copy .data section in parent process to its child. 
  *	Microsoft C/C++ compiler seems use .data section as storage of global
- *	variables.
+ *	variables. Arenas allocated with DkForkAllocArena() are transfered here too.
 -*/
 static BOOL CreateProcDbgEvtHandler()
 {
@@ -302,6 +883,8 @@ static BOOL CreateProcDbgEvtHandler()
 
 	dwAddr = (DWORD64) ((DWORD64) gProcDbgInf.lpBaseOfImage + pSecHdr[dwRes].VirtualAddress);
 	dwSize = (DWORD64) pSecHdr[dwRes].Misc.VirtualSize;
+	DK_VFY_REGION(DKFRK_VFY_REGION_DATA, ".data", dwAddr, dwSize);
+	DK_VFY_PRECOPY(gProcDbgInf.hProcess);
 	fRes = WriteProcessMemory(
 							  gProcDbgInf.hProcess,
 							  (LPVOID) dwAddr,
@@ -309,6 +892,7 @@ static BOOL CreateProcDbgEvtHandler()
 							  (SIZE_T) dwSize,
 							  &stRet
 							  );
+	DK_VFY_COPY_DONE(DKFRK_VFY_REGION_DATA);
 	if  (fRes) {
 		if (stRet != (SIZE_T) dwSize) {
 			DK_DBG(__FUNCTION__, "Error write result less than expected value!", 0);
@@ -318,6 +902,10 @@ static BOOL CreateProcDbgEvtHandler()
 		DK_DBG(__FUNCTION__, "Error WriteProcessMemory()!", GetLastError());
 	}
 
+	if (fRes) {
+		fRes = TransferArenas();
+	}
+
 	if (!fRes) {
 		TerminateProcess(gProcDbgInf.hProcess, -1);
 	}
@@ -325,6 +913,92 @@ static BOOL CreateProcDbgEvtHandler()
 	return fRes;
 }
 
+/*+
+ *	Allocate registered arenas in child process at the same address as in parent 
+ *	and copy their content. This is done at create process debug event, before 
+ *	child run any code, so the addresses are still free in child. Content is 
+ *	written in DKFRK_ARENA_COPY_CHUNK units whatever the arena page size, so large 
+ *	and small page arenas cost the same number of writes.
+ *	Child may not get large pages even if parent has, then its arena is placed on 
+ *	small pages and its copy of gArenas entry (already copied with .data section) 
+ *	is updated, so DkForkArenaPageSize() in child tell what child really got. In 
+ *	verification mode the patched .data block is hashed again.
+-*/
+static BOOL TransferArenas()
+{
+	int				iIdx = 0;
+	BOOL			fRes = TRUE;
+	LPVOID			pAddr = NULL;
+	SIZE_T			stOff = 0, stRet = 0, stLen = 0;
+	DKFRK_ARENA*	pArena = NULL;
+	DKFRK_ARENA		ChildArena = {0};
+
+	for (iIdx = 0; iIdx < DKFRK_MAX_ARENAS; iIdx++)
+	{
+		pArena = &(gArenas[iIdx]);
+		if (pArena->pBase == NULL) continue;
+
+		pAddr = VirtualAllocEx(
+							   gProcDbgInf.hProcess,
+							   pArena->pBase,
+							   pArena->stSize,
+							   MEM_RESERVE | MEM_COMMIT | pArena->dwAllocType,
+							   PAGE_READWRITE
+							   );
+		if ((!pAddr) && (pArena->dwAllocType != 0)) {
+			DK_DBG(__FUNCTION__, "Error VirtualAllocEx() large pages in child, use small pages!", GetLastError());
+			pAddr = VirtualAllocEx(
+								   gProcDbgInf.hProcess,
+								   pArena->pBase,
+								   pArena->stSize,
+								   MEM_RESERVE | MEM_COMMIT,
+								   PAGE_READWRITE
+								   );
+			if (pAddr == pArena->pBase) {
+				RtlCopyMemory(&ChildArena, pArena, sizeof(DKFRK_ARENA));
+				ChildArena.stPageSize = DKFRK_SMALL_PAGE_SIZE;
+				ChildArena.dwAllocType = 0;
+				fRes = WriteProcessMemory(
+										  gProcDbgInf.hProcess,
+										  (LPVOID) pArena,
+										  (LPCVOID) &ChildArena,
+										  sizeof(DKFRK_ARENA),
+										  &stRet
+										  );
+				if ((!fRes) || (stRet != sizeof(DKFRK_ARENA))) {
+					DK_DBG(__FUNCTION__, "Error update arena entry in child process!", GetLastError());
+					return FALSE;
+				}
+				DK_VFY_REHASH(gProcDbgInf.hProcess, pArena, sizeof(DKFRK_ARENA));
+			}
+		}
+		if (pAddr != pArena->pBase) {
+			DK_DBG(__FUNCTION__, "Error VirtualAllocEx() arena in child process!", GetLastError());
+			return FALSE;
+		}
+
+		DK_VFY_REGION(DKFRK_VFY_REGION_ARENA + iIdx, "arena", pArena->pBase, pArena->stSize);
+		for (stOff = 0; stOff < pArena->stSize; stOff += stLen) {
+			stLen = pArena->stSize - stOff;
+			if (stLen > DKFRK_ARENA_COPY_CHUNK) stLen = DKFRK_ARENA_COPY_CHUNK;
+			fRes = WriteProcessMemory(
+									  gProcDbgInf.hProcess,
+									  (LPVOID) ((UCHAR*) pArena->pBase + stOff),
+									  (LPCVOID) ((UCHAR*) pArena->pBase + stOff),
+									  stLen,
+									  &stRet
+									  );
+			if ((!fRes) || (stRet != stLen)) {
+				DK_DBG(__FUNCTION__, "Error WriteProcessMemory() arena!", GetLastError());
+				return FALSE;
+			}
+		}
+		DK_VFY_COPY_DONE(DKFRK_VFY_REGION_ARENA + iIdx);
+	}
+
+	return TRUE;
+}
+
 /*+
  *	Exception debug event handler.
  *	We only interested in break point exception, other exceptions except 
@@ -411,13 +1085,27 @@ static BOOL BreakpointExcHandler()
 								  );
 	} else {
 		DK_DBG(__FUNCTION__, "Main function break point has been reached!", 0);
-		fRes = WriteProcessMemory(
-								  gProcDbgInf.hProcess,
-								  (LPVOID) gulEndBaseFrameAddr,
-								  (LPCVOID) gulEndBaseFrameAddr,
-								  (SIZE_T) (gulStartBaseFrameAddr - gulEndBaseFrameAddr),
-								  NULL
-								  );
+		DK_VFY_REWRITTEN(gProcDbgInf.hProcess);
+		DK_VFY_REGION(
+					  DKFRK_VFY_REGION_STACK, 
+					  "stack", 
+					  gulEndBaseFrameAddr, 
+					  gulStartBaseFrameAddr - gulEndBaseFrameAddr
+					  );
+		fRes = CommitChildStack();
+		if (fRes) {
+			fRes = WriteProcessMemory(
+									  gProcDbgInf.hProcess,
+									  (LPVOID) gulEndBaseFrameAddr,
+									  (LPCVOID) gulEndBaseFrameAddr,
+									  (SIZE_T) (gulStartBaseFrameAddr - gulEndBaseFrameAddr),
+									  NULL
+									  );
+		}
+		DK_VFY_COPY_DONE(DKFRK_VFY_REGION_STACK);
+		if (fRes) {
+			fRes = DK_VFY_TRANSFER(gProcDbgInf.hProcess);
+		}
 		if (fRes) {
 			Ctx.ContextFlags = CONTEXT_CONTROL;
 			fRes = GetThreadContext(gProcDbgInf.hThread, &Ctx);
@@ -435,6 +1123,53 @@ static BOOL BreakpointExcHandler()
 	return fRes;
 }
 
+/*+
+ *	Commit child stack for copied stack frames. At main function break point child
+ *	stack has only a few pages committed and the rest is only reserved, writing deep
+ *	stack frames there would fail. Range from DKFRK_CHILD_STACK_MARGIN below end of
+ *	stack frames up to start of stack frames is committed, and the page below it
+ *	become the new guard page so child stack still grows as usual.
+-*/
+static BOOL CommitChildStack()
+{
+	MEMORY_BASIC_INFORMATION	mbi = {0};
+	DWORD						dwLow = 0, dwHigh = 0;
+	LPVOID						pAddr = NULL;
+
+	if (VirtualQueryEx(gProcDbgInf.hProcess, (LPCVOID) gulEndBaseFrameAddr, &mbi, sizeof(mbi)) == 0) {
+		DK_DBG(__FUNCTION__, "Error VirtualQueryEx() child stack!", GetLastError());
+		return FALSE;
+	}
+
+	dwHigh = (DWORD) ((gulStartBaseFrameAddr + DKFRK_SMALL_PAGE_SIZE - 1) & ~((ULONG64) DKFRK_SMALL_PAGE_SIZE - 1));
+	dwLow = (DWORD) (gulEndBaseFrameAddr & ~((ULONG64) DKFRK_SMALL_PAGE_SIZE - 1));
+	if ((dwLow - (DWORD) mbi.AllocationBase) > (DKFRK_CHILD_STACK_MARGIN + DKFRK_SMALL_PAGE_SIZE)) {
+		dwLow -= DKFRK_CHILD_STACK_MARGIN;
+	} else {
+		dwLow = (DWORD) mbi.AllocationBase + DKFRK_SMALL_PAGE_SIZE;
+	}
+
+	pAddr = VirtualAllocEx(gProcDbgInf.hProcess, (LPVOID) dwLow, dwHigh - dwLow, MEM_COMMIT, PAGE_READWRITE);
+	if (!pAddr) {
+		DK_DBG(__FUNCTION__, "Error VirtualAllocEx() child stack!", GetLastError());
+		return FALSE;
+	}
+
+	pAddr = VirtualAllocEx(
+						   gProcDbgInf.hProcess, 
+						   (LPVOID) (dwLow - DKFRK_SMALL_PAGE_SIZE), 
+						   DKFRK_SMALL_PAGE_SIZE, 
+						   MEM_COMMIT, 
+						   PAGE_READWRITE | PAGE_GUARD
+						   );
+	if (!pAddr) {
+		DK_DBG(__FUNCTION__, "Error set guard page of child stack!", GetLastError());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 /*+
  *	This function is executed by child, and return 0.
  *	Because we've already copy and setup stack frames for child process, this function 
@@ -446,9 +1181,14 @@ static BOOL BreakpointExcHandler()
  *	(this value is return address of the callee) and then "jump" to it.
  *	If you want to know the detail of CALL and RET mechanism and also "stack mechanism", 
  *	please see the Intel processor manual.
+ *	In verification mode child first call DkVfyChild() to check transferred regions, 
+ *	stack pointer is still at the end of copied stack frames so the call don't touch them.
 -*/
 __declspec(naked) int ChildForkProc()
 {
+#ifdef DKFRK_VERIFY
+	__asm call DkVfyChild
+#endif
 	__asm {
 		mov		eax, 0
 		pop		ebp